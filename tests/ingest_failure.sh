@@ -0,0 +1,47 @@
+#!/bin/sh
+# Runs --ingest with the journal unable to grow past 64 KB and checks that the pipeline stops with an error instead
+# of hanging, writes no account file ahead of the journal, and that the next start recovers what was journaled.
+# Usage: ingest_failure.sh <path to the program>
+program=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+printf '1\nAlice\nSavings\n1234567890\n1234\n4\ny\n3\n' | "$program" >/dev/null 2>&1
+account=$(basename "$(grep -l Alice database/[0-9]*.txt)" .txt)
+i=0
+while [ $i -lt 20000 ]; do
+    echo "deposit $account 1"
+    i=$((i + 1))
+done > ops.txt
+
+# Without the signal the write would kill the program instead of failing
+(trap '' XFSZ; ulimit -f 64; timeout 60 "$program" --ingest ops.txt > ingest.txt 2>&1)
+code=$?
+if [ $code -ne 1 ]; then
+    echo "FAIL: --ingest exited with $code, expected 1 (124 means it hung)"
+    cat ingest.txt
+    exit 1
+fi
+grep -q "Failed to log transaction" ingest.txt || { echo "FAIL: no journal error reported"; exit 1; }
+if [ "$(sed -n 7p "database/$account.txt")" != "0.00" ]; then
+    echo "FAIL: the account file was written ahead of the journal"
+    exit 1
+fi
+
+printf '3\n' | timeout 60 "$program" >/dev/null 2>&1
+journaled=0
+for segment in database/journal/segment_*.txt; do
+    count=$(grep -c "^\[ Alice ([0-9]*) <- \]" "$segment")
+    # A deposit that was only half written (no newline yet) was never journaled
+    if [ -n "$(tail -c 1 "$segment")" ] && tail -n 1 "$segment" | grep -q "^\[ Alice ([0-9]*) <- \]"; then
+        count=$((count - 1))
+    fi
+    journaled=$((journaled + count))
+done
+balance=$(sed -n 7p "database/$account.txt")
+if [ "$balance" != "$journaled.00" ]; then
+    echo "FAIL: recovered a balance of $balance, the journal has $journaled deposits"
+    exit 1
+fi
+echo "Ingest stopped with an error after $journaled journaled deposits, all of them recovered"